@@ -1,9 +1,37 @@
 #include "Classes.h"
 
 #include <cassert>
+#include <intrin.h>
+#include <emmintrin.h>
 
 CLASSES_START
 
+//remap kernel shared by every color_replace, a fixed size lets the compiler unroll the chunk loop
+//sse2 has no byte gather, so look up 8 pixels per 64-bit load/store to keep the table lookups independent
+template<size_t fixed_size = 0>
+void remap_bytes(byte* data, size_t size, const byte* replace_scheme)
+{
+    if (fixed_size)
+        size = fixed_size;
+
+    size_t i = 0;
+    for (; i + sizeof uint64_t <= size; i += sizeof uint64_t)
+    {
+        uint64_t chunk;
+        memcpy(&chunk, data + i, sizeof chunk);
+
+        uint64_t result = 0;
+        for (size_t b = 0; b < sizeof uint64_t; b++)
+            result |= static_cast<uint64_t>(replace_scheme[(chunk >> (b * 8)) & 0xffu]) << (b * 8);
+
+        memcpy(data + i, &result, sizeof result);
+    }
+
+    //sizes that aren't a multiple of 8 finish byte by byte, ra2 tiles are 900 bytes and leave 4
+    for (; i < size; i++)
+        data[i] = replace_scheme[data[i]];
+}
+
 tmpfile::tmpfile(std::string filename) :tmpfile()
 {
     load(filename);
@@ -12,16 +40,21 @@ tmpfile::tmpfile(std::string filename) :tmpfile()
 void tmpfile::clear()
 {
     _imageheaders.clear();
-    _original_offsets.clear();
+    _block_indices.clear();
+    _tile_offsets.clear();
+    _source.clear();
 }
 
 bool tmpfile::is_loaded()
 {
-    return !_imageheaders.empty() && !_original_offsets.empty();
+    return !_imageheaders.empty() && !_block_indices.empty();
 }
 
-bool tmpfile::load(std::string filename)
+bool tmpfile::load(std::string filename, bool lazy)
 {
+    if (lazy)
+        return load_index(filename);
+
     clear();
 
     std::ifstream file(filename, std::ios::in | std::ios::binary);
@@ -37,41 +70,258 @@ bool tmpfile::load(std::string filename)
     file.seekg(0, std::ios::beg);
 
     file.read(reinterpret_cast<char*>(buffer.data()), filesize);
+    if (!file)
+        return false;
 
-    tmp_image_header temp;
+    file.close();
+    return load(buffer.data(), buffer.size());
+}
+
+template<typename kernel>
+auto tmpfile::dispatch_geometry(kernel run)
+{
+#ifndef _TMP_GENERIC_GEOMETRY
+    if (_fileheader.block_width == ts_geometry::width && _fileheader.block_height == ts_geometry::height)
+        return run(ts_geometry());
+    if (_fileheader.block_width == ra2_geometry::width && _fileheader.block_height == ra2_geometry::height)
+        return run(ra2_geometry());
+#endif
+    return run(generic_geometry());
+}
 
-    memcpy_s(&_fileheader, sizeof _fileheader, buffer.data(), sizeof _fileheader);
-    _original_offsets.resize(block_count());
+bool tmpfile::load_tiles(const byte* data, size_t filesize, const std::vector<uint32_t>& offsets)
+{
+    //identical tiles, whether they share an offset or are stored twice, are kept once and remapped once
+    //headers include the block position, so copies stored twice only merge when their positions match too
+    std::unordered_map<uint32_t, size_t> loaded_offsets;
+    std::unordered_multimap<size_t, size_t> hashes;
+    const size_t header_size = sizeof tmp_image_header - sizeof std::vector<byte>;
+    const size_t tile = tile_size();
+    tmp_image_header temp;
 
-    size_t current_valid_index = 0;
-    memcpy_s(_original_offsets.data(), block_count() * sizeof uint32_t, &buffer[sizeof _fileheader], block_count() * sizeof uint32_t);
-    for (size_t offset : _original_offsets)
+    _block_indices.assign(block_count(), no_tile);
+    for (size_t block = 0; block < block_count(); block++)
     {
-        const size_t header_size = sizeof tmp_image_header - sizeof std::vector<byte>;
-        if (offset)
+        uint32_t offset = offsets[block];
+        if (!offset)
+            continue;
+
+        auto loaded = loaded_offsets.find(offset);
+        if (loaded != loaded_offsets.end())
+        {
+            _block_indices[block] = loaded->second;
+            continue;
+        }
+
+        if (offset > filesize || filesize - offset < header_size)
+        {
+            clear();
+            return false;
+        }
+
+        //offset += reinterpret_cast<uint32_t>(data);
+        memcpy_s(&temp, header_size, &data[offset], header_size);
+        if (!payload_fits(temp, tile, filesize - offset - header_size))
         {
-            //offset += reinterpret_cast<uint32_t>(buffer.data());
-            memcpy_s(&temp, header_size, &buffer[offset], header_size);
+            clear();
+            return false;
+        }
 
-            temp.pixels.resize(tile_size() * 2);
-            memcpy_s(temp.pixels.data(), tile_size() * 2, &buffer[offset + header_size], tile_size() * 2);
+        size_t extra = temp.ex_flags & 1u ? temp.ex_width * temp.ex_height : 0;
 
-            _imageheaders.push_back(temp);
-            if (has_extra(current_valid_index))
+        const byte* payload = &data[offset + header_size];
+        temp.pixels.assign(payload, payload + tile * 2 + extra * 2);
+
+        size_t hash = tile_hash(temp);
+        size_t index = _imageheaders.size();
+        auto candidates = hashes.equal_range(hash);
+        for (auto candidate = candidates.first; candidate != candidates.second; ++candidate)
+        {
+            tmp_image_header& existing = _imageheaders[candidate->second];
+            if (!memcmp(&existing, &temp, header_size) && existing.pixels == temp.pixels)
             {
-                auto& back = _imageheaders.back();
-                back.pixels.resize(tile_size() * 2 + extra_size(current_valid_index) * 2);
-                memcpy_s(&back.pixels[tile_size() * 2], extra_size(current_valid_index) * 2, &buffer[offset + header_size + tile_size() * 2], extra_size(current_valid_index) * 2);
+                index = candidate->second;
+                break;
             }
+        }
 
-            ++current_valid_index;
+        if (index == _imageheaders.size())
+        {
+            _imageheaders.push_back(temp);
+            hashes.emplace(hash, index);
         }
+
+        loaded_offsets[offset] = index;
+        _block_indices[block] = index;
     }
 
-    file.close();
     return true;
 }
 
+bool tmpfile::load(const byte* data, size_t filesize)
+{
+    clear();
+
+    if (!data || filesize < sizeof _fileheader)
+        return false;
+
+    //every size and offset below comes from the file, so check each one before it is dereferenced
+    memcpy_s(&_fileheader, sizeof _fileheader, data, sizeof _fileheader);
+    if (!_fileheader.xblocks || !_fileheader.yblocks || _fileheader.xblocks > (filesize - sizeof _fileheader) / sizeof uint32_t / _fileheader.yblocks
+        || !valid_geometry(_fileheader))
+        return false;
+
+    std::vector<uint32_t> offsets(block_count());
+    memcpy_s(offsets.data(), block_count() * sizeof uint32_t, &data[sizeof _fileheader], block_count() * sizeof uint32_t);
+
+    return load_tiles(data, filesize, offsets);
+}
+
+bool tmpfile::load_index(std::string filename)
+{
+    clear();
+
+    //a buffer just over one tile header, the default one refills past the header into the payload after every seek
+    char buffer[sizeof tmp_image_header];
+    std::ifstream source;
+    source.rdbuf()->pubsetbuf(buffer, sizeof buffer);
+    source.open(filename, std::ios::in | std::ios::binary);
+    if (!source)
+        return false;
+
+    size_t filesize = source.seekg(0, std::ios::end).tellg();
+    source.seekg(0, std::ios::beg);
+    if (filesize < sizeof _fileheader)
+        return false;
+
+    //same checks as load, but only headers are read, payloads are fetched on first access
+    source.read(reinterpret_cast<char*>(&_fileheader), sizeof _fileheader);
+    if (!source || !_fileheader.xblocks || !_fileheader.yblocks || _fileheader.xblocks > (filesize - sizeof _fileheader) / sizeof uint32_t / _fileheader.yblocks
+        || !valid_geometry(_fileheader))
+        return false;
+
+    std::vector<uint32_t> offsets(block_count());
+    source.read(reinterpret_cast<char*>(offsets.data()), block_count() * sizeof uint32_t);
+    if (!source)
+        return false;
+
+    //without payloads only blocks sharing an offset can be merged
+    std::unordered_map<uint32_t, size_t> loaded_offsets;
+    const size_t header_size = sizeof tmp_image_header - sizeof std::vector<byte>;
+    tmp_image_header temp;
+
+    bool valid = true;
+    _block_indices.assign(block_count(), no_tile);
+    for (size_t block = 0; block < block_count() && valid; block++)
+    {
+        uint32_t offset = offsets[block];
+        if (!offset)
+            continue;
+
+        auto loaded = loaded_offsets.find(offset);
+        if (loaded != loaded_offsets.end())
+        {
+            _block_indices[block] = loaded->second;
+            continue;
+        }
+
+        if (offset > filesize || filesize - offset < header_size)
+        {
+            valid = false;
+            break;
+        }
+
+        source.seekg(offset, std::ios::beg);
+        source.read(reinterpret_cast<char*>(&temp), header_size);
+
+        valid = source && payload_fits(temp, tile_size(), filesize - offset - header_size);
+        if (!valid)
+            break;
+
+        loaded_offsets[offset] = _imageheaders.size();
+        _block_indices[block] = _imageheaders.size();
+        _imageheaders.push_back(temp);
+        _tile_offsets.push_back(offset);
+    }
+
+    if (!valid)
+    {
+        clear();
+        return false;
+    }
+
+    _source = filename;
+    return true;
+}
+
+bool tmpfile::fetch(size_t index)
+{
+    tmp_image_header& tile = _imageheaders[index];
+    if (!tile.pixels.empty() || _source.empty())
+        return !tile.pixels.empty();
+
+    //opened per access instead of kept open, so indexing thousands of files can't run out of crt streams
+    std::ifstream source(_source, std::ios::in | std::ios::binary);
+    return fetch(index, source);
+}
+
+bool tmpfile::fetch(size_t index, std::ifstream& source)
+{
+    tmp_image_header& tile = _imageheaders[index];
+    if (!tile.pixels.empty())
+        return true;
+
+    const size_t header_size = sizeof tmp_image_header - sizeof std::vector<byte>;
+    tile.pixels.resize(tile_size() * 2 + extra_size(index) * 2);
+
+    source.clear();
+    source.seekg(_tile_offsets[index] + header_size, std::ios::beg);
+    source.read(reinterpret_cast<char*>(tile.pixels.data()), tile.pixels.size());
+    if (!source)
+    {
+        tile.pixels.clear();
+        return false;
+    }
+
+    return true;
+}
+
+bool tmpfile::materialize()
+{
+    if (_source.empty())
+        return true;
+
+    std::ifstream source(_source, std::ios::in | std::ios::binary);
+    for (size_t i = 0; i < valid_block_count(); i++)
+    {
+        if (!fetch(i, source))
+            return false;
+    }
+
+    //every payload is in memory now, so the file can be rewritten
+    _source.clear();
+    return true;
+}
+
+size_t tmpfile::estimate_memory(std::string filename)
+{
+    std::ifstream file(filename, std::ios::in | std::ios::binary);
+    if (!file)
+        return 0;
+
+    size_t filesize = file.seekg(0, std::ios::end).tellg();
+    file.seekg(0, std::ios::beg);
+
+    tmp_file_header header{ 0 };
+    file.read(reinterpret_cast<char*>(&header), sizeof header);
+    if (!file)
+        return filesize;
+
+    //load buffer, parsed tiles and save buffer are each about the file size, plus one image header per block
+    size_t blocks = std::min<size_t>(header.xblocks * header.yblocks, filesize / sizeof uint32_t);
+    return filesize * 3 + blocks * sizeof tmp_image_header;
+}
+
 size_t tmpfile::block_count()
 {
     return _fileheader.xblocks* _fileheader.yblocks;
@@ -82,21 +332,64 @@ size_t tmpfile::valid_block_count()
     return _imageheaders.size();
 }
 
+size_t tmpfile::block_tile(size_t block)
+{
+    if (block >= _block_indices.size())
+        return no_tile;
+    return _block_indices[block];
+}
+
+bool tmpfile::valid_geometry(const tmp_file_header& header)
+{
+    return header.block_width <= max_dimension && header.block_height <= max_dimension;
+}
+
+bool tmpfile::payload_fits(const tmp_image_header& header, size_t tile, size_t available)
+{
+    //divide instead of multiplying, available is the only size here not taken from the file
+    if (tile > available / 2)
+        return false;
+    if (!(header.ex_flags & 1u))
+        return true;
+    if (header.ex_width > max_dimension || header.ex_height > max_dimension)
+        return false;
+    return header.ex_width * header.ex_height <= (available - tile * 2) / 2;
+}
+
+size_t tmpfile::tile_hash(const tmp_image_header& tile)
+{
+    //fnv-1a over the on-disk header only, it holds the block position so payloads are compared for the few tiles that collide
+    const size_t header_size = sizeof tmp_image_header - sizeof std::vector<byte>;
+    const byte* data = reinterpret_cast<const byte*>(&tile);
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < header_size; i++)
+        hash = (hash ^ data[i]) * 1099511628211ull;
+
+    return static_cast<size_t>(hash);
+}
+
 size_t tmpfile::tile_size()
 {
     return _fileheader.block_height * _fileheader.block_width / 2;
 }
 
-byte* tmpfile::color_data(size_t index)
+const tmp_image_header* tmpfile::tile_header(size_t index)
 {
     if (index >= _imageheaders.size())
         return nullptr;
+    return &_imageheaders[index];
+}
+
+byte* tmpfile::color_data(size_t index)
+{
+    if (index >= _imageheaders.size() || !fetch(index))
+        return nullptr;
     return _imageheaders[index].pixels.data();
 }
 
 byte* tmpfile::zbuffer_data(size_t index)
 {
-    if (index >= _imageheaders.size())
+    if (index >= _imageheaders.size() || !fetch(index))
         return nullptr;
     return &_imageheaders[index].pixels[tile_size()];
 }
@@ -110,14 +403,14 @@ bool tmpfile::has_extra(size_t index)
 
 byte* tmpfile::extra_data(size_t index)
 {
-    if (!has_extra(index))
+    if (!has_extra(index) || !fetch(index))
         return nullptr;
     return &_imageheaders[index].pixels[tile_size() * 2];
 }
 
 byte* tmpfile::extra_zbuffer(size_t index)
 {
-    if (!has_extra(index))
+    if (!has_extra(index) || !fetch(index))
         return nullptr;
     return &_imageheaders[index].pixels[tile_size() * 2 + extra_size(index)];
 }
@@ -135,19 +428,76 @@ bool tmpfile::color_replace(std::vector<byte> replace_scheme)
     if (!is_loaded() || replace_scheme.size() != valid_color_count)
         return false;
 
+    return dispatch_geometry([&](auto geometry) { return remap_tiles<decltype(geometry)>(replace_scheme.data()); });
+}
+
+template<typename geometry>
+bool tmpfile::remap_tiles(const byte* replace_scheme)
+{
+    //straight to the payloads, the public accessors re-check the index and recompute offsets on every call
+    const size_t tile = geometry::tile_size ? geometry::tile_size : tile_size();
+    const size_t extra_offset = geometry::payload_size ? geometry::payload_size : tile * 2;
     for (size_t i = 0; i < valid_block_count(); i++)
     {
-        byte* colors = color_data(i);
-        for (size_t x = 0; x < tile_size(); x++)
-            colors[x] = replace_scheme[colors[x]];
+        if (!fetch(i))
+            return false;
+
+        tmp_image_header& header = _imageheaders[i];
+        remap_bytes<geometry::tile_size>(header.pixels.data(), tile, replace_scheme);
+        if (header.ex_flags & 1u)
+            remap_bytes(header.pixels.data() + extra_offset, header.ex_width * header.ex_height, replace_scheme);
+    }
+
+    return true;
+}
+
+bool tmpfile::color_replace(byte* data, size_t filesize, std::vector<byte> replace_scheme)
+{
+    const size_t valid_color_count = 256;
+    const size_t header_size = sizeof tmp_image_header - sizeof std::vector<byte>;
+    tmp_file_header fileheader{ 0 };
+    tmp_image_header header;
+
+    if (!data || filesize < sizeof fileheader || replace_scheme.size() != valid_color_count)
+        return false;
+
+    memcpy_s(&fileheader, sizeof fileheader, data, sizeof fileheader);
+    if (!fileheader.xblocks || !fileheader.yblocks || fileheader.xblocks > (filesize - sizeof fileheader) / sizeof uint32_t / fileheader.yblocks
+        || !valid_geometry(fileheader))
+        return false;
+
+    const size_t blocks = fileheader.xblocks * fileheader.yblocks;
+    const size_t tile = fileheader.block_width * fileheader.block_height / 2;
+    const uint32_t* offsets = reinterpret_cast<const uint32_t*>(&data[sizeof fileheader]);
 
-        if (byte* extras = extra_data(i))
+    //the first pass only validates, so a malformed buffer is rejected before any byte of it is changed
+    std::unordered_set<uint32_t> visited;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        visited.clear();
+        for (size_t i = 0; i < blocks; i++)
         {
-            for (size_t x = 0; x < extra_size(i); x++)
-                extras[x] = replace_scheme[extras[x]];
+            uint32_t offset = offsets[i];
+            if (!offset || !visited.insert(offset).second)
+                continue;
+
+            if (offset > filesize || filesize - offset < header_size)
+                return false;
+
+            memcpy_s(&header, header_size, &data[offset], header_size);
+            if (!payload_fits(header, tile, filesize - offset - header_size))
+                return false;
+
+            size_t extra = header.ex_flags & 1u ? header.ex_width * header.ex_height : 0;
+
+            if (!pass)
+                continue;
+
+            remap_bytes(&data[offset + header_size], tile, replace_scheme.data());
+            remap_bytes(&data[offset + header_size + tile * 2], extra, replace_scheme.data());
         }
     }
-    
+
     return true;
 }
 
@@ -158,8 +508,8 @@ size_t tmpfile::calculate_file_size()
 
     const size_t header_size = sizeof tmp_image_header - sizeof std::vector<byte>;
     size_t total_size = sizeof _fileheader + block_count() * sizeof uint32_t;
-    for (auto& block_data : _imageheaders)
-        total_size += header_size + block_data.pixels.size();
+    for (size_t i = 0; i < valid_block_count(); i++)
+        total_size += header_size + tile_size() * 2 + extra_size(i) * 2;
 
     return total_size;
 }
@@ -169,11 +519,25 @@ bool tmpfile::save(std::string filename)
     if (!is_loaded())
         return false;
 
+    //build the image first, a lazily loaded file still reads its payloads from filename
     std::vector<byte> filebuffer;
+    if (!save(filebuffer))
+        return false;
+
     std::ofstream file(filename, std::ios::out | std::ios::binary);
     if (!file)
         return false;
 
+    file.write(reinterpret_cast<char*>(filebuffer.data()), filebuffer.size());
+    file.close();
+    return true;
+}
+
+bool tmpfile::save(std::vector<byte>& filebuffer)
+{
+    if (!is_loaded() || !materialize())
+        return false;
+
     filebuffer.resize(calculate_file_size());
     const size_t image_header_size = sizeof tmp_image_header - sizeof std::vector<byte>;
 
@@ -182,22 +546,25 @@ bool tmpfile::save(std::string filename)
     
     uint32_t* offsets = reinterpret_cast<uint32_t*>(&filebuffer[sizeof _fileheader]);
     uint32_t current_offset = sizeof _fileheader + block_count() * sizeof uint32_t;
-    size_t block_data_size = image_header_size + tile_size() * 2;
+    std::vector<uint32_t> tile_offsets(valid_block_count());
 
-    //memset(offsets, 0, block_count() * sizeof uint32_t);
-    memcpy_s(offsets, block_count() * sizeof uint32_t, _original_offsets.data(), block_count() * sizeof uint32_t);
     for (size_t i = 0; i < valid_block_count(); i++)
     {
         auto& block_data = _imageheaders[i];
         memcpy_s(&filebuffer[current_offset], image_header_size, &block_data, image_header_size);
         memcpy_s(&filebuffer[current_offset + image_header_size], block_data.pixels.size(), block_data.pixels.data(), block_data.pixels.size());
 
-        //offsets[i] = current_offset;
+        tile_offsets[i] = current_offset;
         current_offset += image_header_size + block_data.pixels.size();
     }
 
-    file.write(reinterpret_cast<char*>(filebuffer.data()), filebuffer.size());
-    file.close();
+    //duplicate blocks share one payload through their offset table entries
+    for (size_t block = 0; block < block_count(); block++)
+    {
+        if (_block_indices[block] != no_tile)
+            offsets[block] = tile_offsets[_block_indices[block]];
+    }
+
     return true;
 }
 
@@ -222,8 +589,25 @@ bool palette::load(std::string filename)
     if (filesize != valid_palsize)
         return false;
 
+    byte buffer[valid_palsize];
+    file.read(reinterpret_cast<char*>(buffer), valid_palsize);
+    file.close();
+
+    return load(buffer, valid_palsize);
+}
+
+bool palette::load(const byte* data, size_t size)
+{
+    const size_t valid_color_count = 256;
+    constexpr size_t valid_palsize = valid_color_count * sizeof color;
+
+    clear();
+
+    if (!data || size != valid_palsize)
+        return false;
+
     _entries.resize(valid_color_count);
-    file.read(reinterpret_cast<char*>(_entries.data()), valid_palsize);
+    memcpy_s(_entries.data(), valid_palsize, data, valid_palsize);
     for (auto& color : _entries)
     {
         color.r <<= 2;
@@ -231,7 +615,6 @@ bool palette::load(std::string filename)
         color.b <<= 2;
     }
 
-    file.close();
     return true;
 }
 
@@ -299,12 +682,16 @@ shpfile::shpfile(std::string filename) :shpfile()
 void shpfile::clear()
 {
     _frameheaders.clear();
+    _framekinds.clear();
     _pixels.clear();
+    _attached = nullptr;
+    _attached_size = 0;
+    touch();
 }
 
 bool shpfile::is_loaded()
 {
-    return !_frameheaders.empty() && !_pixels.empty();
+    return !_frameheaders.empty() && pixels_size();
 }
 
 bool shpfile::load(std::string filename)
@@ -322,112 +709,641 @@ bool shpfile::load(std::string filename)
     buffer.resize(filesize);
 
     file.read(reinterpret_cast<char*>(buffer.data()), filesize);
-    memcpy_s(&_fileheader, sizeof _fileheader, buffer.data(), sizeof _fileheader);
-    
-    _frameheaders.resize(frame_count());
-    memcpy_s(_frameheaders.data(), frame_count() * sizeof shp_frame_header, &buffer[sizeof _fileheader], frame_count() * sizeof shp_frame_header);
+    if (!file)
+        return false;
+
+    file.close();
+    return load(buffer.data(), buffer.size());
+}
+
+bool shpfile::load(const byte* data, size_t filesize)
+{
+    clear();
+
+    if (!load_headers(data, filesize))
+        return false;
 
     uint32_t pixels_offset = sizeof _fileheader + frame_count() * sizeof shp_frame_header;
-    size_t pixels_size = buffer.size() - pixels_offset;
+    size_t pixels_size = filesize - pixels_offset;
 
     _pixels.resize(pixels_size);
-    memcpy_s(_pixels.data(), pixels_size, &buffer[pixels_offset], pixels_size);
+    memcpy_s(_pixels.data(), pixels_size, &data[pixels_offset], pixels_size);
 
-    file.close();
+    classify_frames();
     return true;
 }
 
-size_t shpfile::frame_count()
+bool shpfile::attach(byte* data, size_t filesize)
 {
-    return _fileheader.frames;
+    clear();
+
+    if (!load_headers(data, filesize))
+        return false;
+
+    uint32_t pixels_offset = sizeof _fileheader + frame_count() * sizeof shp_frame_header;
+    _attached = data + pixels_offset;
+    _attached_size = filesize - pixels_offset;
+
+    classify_frames();
+    return true;
 }
 
-byte* shpfile::pixel_data(size_t index)
+bool shpfile::load_headers(const byte* data, size_t filesize)
 {
-    if (index >= _frameheaders.size())
-        return nullptr;
+    if (!data || filesize < sizeof _fileheader)
+        return false;
 
-    shp_frame_header& header = _frameheaders[index];
-    uint32_t offset = header.data_offset - sizeof _fileheader - _frameheaders.size() * sizeof shp_frame_header;
+    memcpy_s(&_fileheader, sizeof _fileheader, data, sizeof _fileheader);
+    if (filesize - sizeof _fileheader < frame_count() * sizeof shp_frame_header)
+        return false;
     
-    return &_pixels[offset];
+    _frameheaders.resize(frame_count());
+    memcpy_s(_frameheaders.data(), frame_count() * sizeof shp_frame_header, &data[sizeof _fileheader], frame_count() * sizeof shp_frame_header);
+    return true;
 }
 
-rectangle shpfile::frame_bound(size_t index)
+void shpfile::classify_frames()
 {
-    rectangle temp{ 0,0,0,0 };
-
-    if (index >= _frameheaders.size())
-        return temp;
+    _framekinds.resize(frame_count());
+    for (size_t i = 0; i < frame_count(); i++)
+        _framekinds[i] = classify_frame(i);
+}
 
-    shp_frame_header& frame_data = _frameheaders[index];
-    temp = { frame_data.x,frame_data.y,frame_data.width,frame_data.height };
-    
-    return temp;
+byte* shpfile::pixels()
+{
+    return _attached ? _attached : _pixels.data();
 }
 
-rectangle shpfile::file_bound()
+size_t shpfile::pixels_size()
 {
-    return rectangle{ 0,0,_fileheader.width,_fileheader.height };
+    return _attached ? _attached_size : _pixels.size();
 }
 
-bool shpfile::color_replace(std::vector<byte> replace_scheme)
+size_t shpfile::estimate_memory(std::string filename, bool crop)
 {
-    const size_t valid_replace_count = 256;
+    std::ifstream file(filename, std::ios::in | std::ios::binary);
+    if (!file)
+        return 0;
 
-    if (!is_loaded() || replace_scheme.size() != valid_replace_count)
-        return false;
+    size_t filesize = file.seekg(0, std::ios::end).tellg();
+    file.seekg(0, std::ios::beg);
+
+    shp_file_header header{ 0 };
+    file.read(reinterpret_cast<char*>(&header), sizeof header);
+    if (!file)
+        return filesize;
+
+    //load buffer and parsed pixels are each about the file size, save streams straight from them
+    size_t estimate = filesize * 2 + header.frames * (sizeof shp_frame_header + sizeof shp_frame_kind);
+
+    //cropping builds the new pixels next to the old ones, decoding each frame into a canvas sized bitmap
+    if (crop)
+        estimate += filesize + static_cast<size_t>(header.width) * header.height + header.frames * sizeof shp_frame_header;
+    return estimate;
+}
+
+size_t shpfile::frame_count()
+{
+    return _fileheader.frames;
+}
+
+byte* shpfile::pixel_data(size_t index)
+{
+    if (index >= _frameheaders.size())
+        return nullptr;
+
+    shp_frame_header& header = _frameheaders[index];
+    const size_t pixels_offset = sizeof _fileheader + _frameheaders.size() * sizeof shp_frame_header;
+    if (header.data_offset < pixels_offset || header.data_offset - pixels_offset >= pixels_size())
+        return nullptr;
+
+    uint32_t offset = header.data_offset - pixels_offset;
+    return pixels() + offset;
+}
+
+rectangle shpfile::frame_bound(size_t index)
+{
+    rectangle temp{ 0,0,0,0 };
+
+    if (index >= _frameheaders.size())
+        return temp;
+
+    shp_frame_header& frame_data = _frameheaders[index];
+    temp = { frame_data.x,frame_data.y,frame_data.width,frame_data.height };
+    
+    return temp;
+}
+
+rectangle shpfile::file_bound()
+{
+    return rectangle{ 0,0,_fileheader.width,_fileheader.height };
+}
+
+size_t shpfile::generation()
+{
+    return _generation;
+}
+
+void shpfile::touch()
+{
+    //process-wide counter, so a generation never repeats even if another shpfile reuses this address
+    static std::atomic<size_t> generations{ 0 };
+    _generation = ++generations;
+}
+
+std::vector<byte> shpfile::frame_view(size_t index, std::vector<byte> replace_scheme)
+{
+    const size_t valid_replace_count = 256;
+    std::vector<byte> canvas;
+
+    if (!is_loaded() || index >= _frameheaders.size())
+        return canvas;
+    if (!replace_scheme.empty() && replace_scheme.size() != valid_replace_count)
+        return canvas;
+
+    rectangle canvas_bound = file_bound();
+    rectangle bound = frame_bound(index);
+    canvas.resize(canvas_bound.width * canvas_bound.height);
+    if (frame_kind(index) == Empty)
+        return canvas;
+
+    //shadow frames are never remapped, see color_replace
+    const byte* scheme = replace_scheme.empty() || frame_kind(index) == Shadow ? nullptr : replace_scheme.data();
+    decode_frame(index, canvas.data(), canvas_bound.width, canvas_bound.height, bound.x, bound.y, scheme);
+
+    return canvas;
+}
+
+void shpfile::decode_frame(size_t index, byte* target, size_t target_width, size_t target_height, int64_t x, int64_t y, const byte* replace_scheme)
+{
+    rectangle bound = frame_bound(index);
+    byte* colors = pixel_data(index);
+    if (!colors)
+        return;
+
+    shp_compression compression = frame_compression(index);
+
+    //copies a run of frame pixels into the target, clipped against both the frame and the target
+    auto put_pixels = [&](size_t line, size_t column, const byte* source, size_t count)
+    {
+        if (column >= bound.width)
+            return;
+        count = std::min<size_t>(count, bound.width - column);
+
+        int64_t row = y + line;
+        int64_t left = x + column;
+        if (row < 0 || row >= static_cast<int64_t>(target_height))
+            return;
+
+        int64_t first = std::max<int64_t>(0, -left);
+        int64_t last = std::min<int64_t>(count, static_cast<int64_t>(target_width) - left);
+        byte* destination = &target[row * target_width];
+        for (int64_t i = first; i < last; i++)
+            destination[left + i] = replace_scheme ? replace_scheme[source[i]] : source[i];
+    };
+
+    for (size_t l = 0; l < bound.height; l++)
+    {
+        size_t size;
+        const byte* line = next_line(colors, bound.width, compression, size);
+        if (!line)
+            break;
+
+        if (compression != RunLengthZero)
+        {
+            put_pixels(l, 0, line, size);
+            continue;
+        }
+
+        size_t position = 0;
+        size_t column = 0;
+        while (position < size && column < bound.width)
+        {
+            size_t literals = find_zero(line + position, size - position);
+            put_pixels(l, column, line + position, literals);
+
+            column += literals;
+            position += literals;
+            if (position + 1 < size)
+                column += line[position + 1];
+            position += 2;
+        }
+    }
+}
+
+shp_compression shpfile::frame_compression(size_t index)
+{
+    if (index >= _frameheaders.size())
+        return Raw;
+
+    //the low byte of flags holds the compression type, anything unknown is treated as raw
+    byte compression = _frameheaders[index].flags & 0xffu;
+    if (compression == Lined || compression == RunLengthZero)
+        return static_cast<shp_compression>(compression);
+    return Raw;
+}
+
+size_t shpfile::find_zero(const byte* data, size_t size)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + sizeof __m128i <= size; i += sizeof __m128i)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        unsigned long mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero));
+        if (mask)
+        {
+            unsigned long first;
+            _BitScanForward(&first, mask);
+            return i + first;
+        }
+    }
+
+    for (; i < size; i++)
+    {
+        if (!data[i])
+            return i;
+    }
+    return size;
+}
+
+void shpfile::remap_zero_line(byte* line, size_t size, const byte* replace_scheme)
+{
+    size_t position = 0;
+    while (position < size)
+    {
+        size_t literals = find_zero(line + position, size - position);
+        remap_bytes(line + position, literals, replace_scheme);
+
+        //skip the (0, count) pair that ends the literal run
+        position += literals + 2;
+    }
+}
+
+byte* shpfile::next_line(byte*& cursor, size_t width, shp_compression compression, size_t& size)
+{
+    size_t available = pixels() + pixels_size() - cursor;
+    if (compression == Raw)
+    {
+        if (available < width)
+            return nullptr;
+
+        byte* line = cursor;
+        size = width;
+        cursor += width;
+        return line;
+    }
+
+    if (available < sizeof uint16_t)
+        return nullptr;
+
+    uint16_t pitch = *reinterpret_cast<uint16_t*>(cursor);
+    if (pitch < sizeof uint16_t || available < pitch)
+        return nullptr;
+
+    byte* line = cursor + sizeof uint16_t;
+    size = pitch - sizeof uint16_t;
+    cursor += pitch;
+    return line;
+}
+
+bool shpfile::is_shadow_span(const byte* data, size_t size)
+{
+    const __m128i ones = _mm_set1_epi8(1);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    //saturating x - 1 is zero only for indices 0 and 1
+    for (; i + sizeof __m128i <= size; i += sizeof __m128i)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(chunk, ones), zero)) != 0xffff)
+            return false;
+    }
+
+    for (; i < size; i++)
+    {
+        if (data[i] > 1)
+            return false;
+    }
+    return true;
+}
+
+shp_frame_kind shpfile::classify_frame(size_t index)
+{
+    shp_frame_header& header = _frameheaders[index];
+    byte* colors = pixel_data(index);
+    if (!colors || !header.width || !header.height)
+        return Empty;
+
+    //unit and building shps store one shadow frame per normal frame in their second half
+    if (frame_count() % 2 || index < frame_count() / 2)
+        return Normal;
+
+    shp_compression compression = frame_compression(index);
+    for (size_t l = 0; l < header.height; l++)
+    {
+        size_t size;
+        byte* line = next_line(colors, header.width, compression, size);
+        if (!line)
+            return Normal;
+
+        if (compression != RunLengthZero)
+        {
+            if (!is_shadow_span(line, size))
+                return Normal;
+            continue;
+        }
+
+        size_t position = 0;
+        while (position < size)
+        {
+            size_t literals = find_zero(line + position, size - position);
+            if (!is_shadow_span(line + position, literals))
+                return Normal;
+            position += literals + 2;
+        }
+    }
+
+    return Shadow;
+}
+
+shp_frame_kind shpfile::frame_kind(size_t index)
+{
+    if (index >= _framekinds.size())
+        return Empty;
+    return _framekinds[index];
+}
+
+bool shpfile::color_replace(std::vector<byte> replace_scheme)
+{
+    const size_t valid_replace_count = 256;
+
+    if (!is_loaded() || replace_scheme.size() != valid_replace_count)
+        return false;
+
+    const byte* scheme = replace_scheme.data();
+    for (size_t i = 0; i < frame_count(); i++)
+    {
+        //shadow frames only hold the palette independent indices 0 and 1, empty ones hold nothing
+        if (frame_kind(i) != Normal)
+            continue;
 
-    for (size_t i = 0; i < frame_count(); i++)
-    {
         byte* colors = pixel_data(i);
         shp_frame_header& header = _frameheaders[i];
-        if (!colors)
-            continue;
+        shp_compression compression = frame_compression(i);
 
-        size_t width = header.width;
-        size_t height = header.height;
-        bool has_compression = header.flags & 2u;
+        for (size_t l = 0; l < header.height; l++)
+        {
+            size_t size;
+            byte* line = next_line(colors, header.width, compression, size);
+            if (!line)
+                break;
+
+            if (compression == RunLengthZero)
+                remap_zero_line(line, size, scheme);
+            else
+                remap_bytes(line, size, scheme);
+        }
+    }
+    touch();
+    return true;
+}
+
+bool shpfile::opaque_bounds(const byte* row, size_t width, size_t& first, size_t& last)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    //find the first 16 byte block holding an opaque pixel, then walk back from the end for the last one
+    for (; i + sizeof __m128i <= width; i += sizeof __m128i)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero)) != 0xffff)
+            break;
+    }
+    for (; i < width && !row[i]; i++);
+    if (i == width)
+        return false;
+    first = i;
+
+    size_t end = width;
+    for (; end >= first + sizeof __m128i; end -= sizeof __m128i)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + end - sizeof __m128i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero)) != 0xffff)
+            break;
+    }
+    for (; !row[end - 1]; end--);
+    last = end - 1;
+
+    return true;
+}
+
+bool shpfile::encode_line(const byte* row, size_t width, shp_compression compression, std::vector<byte>& payload)
+{
+    if (compression == Raw)
+    {
+        payload.insert(payload.end(), row, row + width);
+        return true;
+    }
+
+    size_t pitch_position = payload.size();
+    payload.resize(payload.size() + sizeof uint16_t);
 
-        if (has_compression)
+    if (compression == Lined)
+    {
+        payload.insert(payload.end(), row, row + width);
+    }
+    else
+    {
+        for (size_t x = 0; x < width;)
         {
-            for (size_t l = 0; l < height; l++)
+            if (row[x])
             {
-                byte* current = colors + sizeof uint16_t;
-                uint16_t pitch = *reinterpret_cast<uint16_t*>(colors);
-
-                while (current != colors + pitch)
-                {
-                    if (*current)
-                    {
-                        *current = replace_scheme[*current];
-                        current++;
-                    }
-                    else
-                    {
-                        current += 2;
-                    }
-                }
-                colors += pitch;
+                size_t literals = find_zero(row + x, width - x);
+                payload.insert(payload.end(), row + x, row + x + literals);
+                x += literals;
+                continue;
             }
+
+            size_t zeros = 1;
+            while (x + zeros < width && !row[x + zeros] && zeros < 0xff)
+                zeros++;
+
+            payload.push_back(0);
+            payload.push_back(static_cast<byte>(zeros));
+            x += zeros;
+        }
+    }
+
+    size_t pitch = payload.size() - pitch_position;
+    if (pitch > 0xffff)
+        return false;
+
+    uint16_t stored = static_cast<uint16_t>(pitch);
+    memcpy(&payload[pitch_position], &stored, sizeof stored);
+    return true;
+}
+
+size_t shpfile::payload_size(size_t index)
+{
+    byte* colors = pixel_data(index);
+    if (!colors)
+        return 0;
+
+    byte* cursor = colors;
+    shp_frame_header& header = _frameheaders[index];
+    for (size_t l = 0; l < header.height; l++)
+    {
+        size_t size;
+        if (!next_line(cursor, header.width, frame_compression(index), size))
+            break;
+    }
+
+    return cursor - colors;
+}
+
+size_t shpfile::crop_frames()
+{
+    if (!is_loaded())
+        return 0;
+
+    struct crop
+    {
+        shp_frame_header original;
+        shp_frame_header cropped;
+    };
+
+    const size_t pixels_offset = sizeof _fileheader + _frameheaders.size() * sizeof shp_frame_header;
+    const size_t original_size = pixels_size();
+    std::vector<shp_frame_header> headers = _frameheaders;
+    std::vector<byte> cropped_pixels;
+    std::unordered_map<uint32_t, crop> crops;//frames sharing a payload are cropped once
+    std::vector<byte> bitmap;
+    std::vector<byte> payload;
+
+    for (size_t i = 0; i < frame_count(); i++)
+    {
+        shp_frame_header& header = headers[i];
+        if (frame_kind(i) == Empty)
+        {
+            header.data_offset = 0;
+            continue;
+        }
+
+        auto shared = crops.find(header.data_offset);
+        if (shared != crops.end() && shared->second.original.width == header.width && shared->second.original.height == header.height
+            && shared->second.original.flags == header.flags)
+        {
+            const crop& done = shared->second;
+            header.x += done.cropped.x - done.original.x;
+            header.y += done.cropped.y - done.original.y;
+            header.width = done.cropped.width;
+            header.height = done.cropped.height;
+            header.data_offset = done.cropped.data_offset;
+            continue;
+        }
+
+        //the smallest payload that can describe the frame, a zero run covers at most 255 pixels
+        shp_frame_header original = header;
+        shp_compression compression = frame_compression(i);
+        size_t area = static_cast<size_t>(header.width) * header.height;
+        size_t least_payload = area;
+        if (compression == Lined)
+            least_payload = area + header.height * sizeof uint16_t;
+        else if (compression == RunLengthZero)
+            least_payload = header.height * (sizeof uint16_t + (header.width + 0xfeu) / 0xffu * 2);
+
+        //frames larger than the canvas or than their payload can cover are malformed, keep them as they are rather than decode them
+        rectangle canvas = file_bound();
+        size_t original_payload = payload_size(i);
+        if (header.width > canvas.width || header.height > canvas.height || original_payload < least_payload)
+        {
+            byte* colors = pixel_data(i);
+            header.data_offset = static_cast<uint32_t>(pixels_offset + cropped_pixels.size());
+            cropped_pixels.insert(cropped_pixels.end(), colors, colors + original_payload);
+            crops[original.data_offset] = crop{ original, header };
+            continue;
+        }
+
+        bitmap.assign(area, 0);
+        decode_frame(i, bitmap.data(), header.width, header.height, 0, 0, nullptr);
+
+        size_t top = header.height;
+        size_t bottom = 0;
+        size_t left = header.width;
+        size_t right = 0;
+        for (size_t l = 0; l < header.height; l++)
+        {
+            size_t first, last;
+            if (!opaque_bounds(&bitmap[l * header.width], header.width, first, last))
+                continue;
+
+            top = std::min<size_t>(top, l);
+            bottom = l;
+            left = std::min<size_t>(left, first);
+            right = std::max<size_t>(right, last);
+        }
+
+        if (top == header.height)
+        {
+            //nothing opaque, the frame becomes an empty one
+            header.width = 0;
+            header.height = 0;
+            header.data_offset = 0;
         }
         else
         {
-            for (size_t l = 0; l < height; l++)
+            size_t width = right - left + 1;
+            size_t height = bottom - top + 1;
+            bool encoded = true;
+
+            payload.clear();
+            for (size_t l = top; l <= bottom && encoded; l++)
+                encoded = encode_line(&bitmap[l * header.width + left], width, compression, payload);
+
+            //keep the original payload when cropping doesn't pay off
+            if (!encoded || payload.size() >= original_payload)
+            {
+                byte* colors = pixel_data(i);
+                payload.assign(colors, colors + original_payload);
+            }
+            else
             {
-                for (size_t x = 0; x < width; x++)
-                    colors[l * width + x] = replace_scheme[colors[l * width + x]];
+                header.x += static_cast<int16_t>(left);
+                header.y += static_cast<int16_t>(top);
+                header.width = static_cast<uint16_t>(width);
+                header.height = static_cast<uint16_t>(height);
             }
+
+            header.data_offset = static_cast<uint32_t>(pixels_offset + cropped_pixels.size());
+            cropped_pixels.insert(cropped_pixels.end(), payload.begin(), payload.end());
         }
+
+        crops[original.data_offset] = crop{ original, header };
     }
-    return true;
+
+    //an all-empty file would otherwise lose its pixel buffer and stop counting as loaded
+    if (cropped_pixels.empty() || cropped_pixels.size() >= original_size)
+        return 0;
+
+    _frameheaders = headers;
+    _pixels = cropped_pixels;
+    _attached = nullptr;
+    _attached_size = 0;
+    classify_frames();
+    touch();
+
+    return original_size - _pixels.size();
 }
 
 size_t shpfile::calculate_file_size()
 {
     if (!is_loaded())
         return 0;
-    return sizeof _fileheader + frame_count() * sizeof shp_frame_header + _pixels.size();
+    return sizeof _fileheader + frame_count() * sizeof shp_frame_header + pixels_size();
 }
 
 bool shpfile::save(std::string filename)
@@ -441,12 +1357,860 @@ bool shpfile::save(std::string filename)
 
     file.write(reinterpret_cast<char*>(&_fileheader), sizeof _fileheader);
     file.write(reinterpret_cast<char*>(_frameheaders.data()), _frameheaders.size() * sizeof shp_frame_header);
-    file.write(reinterpret_cast<char*>(_pixels.data()), _pixels.size());
+    file.write(reinterpret_cast<char*>(pixels()), pixels_size());
 
     file.close();
     return true;
 }
 
+bool shpfile::save(std::vector<byte>& filebuffer)
+{
+    if (!is_loaded())
+        return false;
+
+    const size_t headers_size = _frameheaders.size() * sizeof shp_frame_header;
+    filebuffer.resize(calculate_file_size());
+
+    memcpy_s(filebuffer.data(), sizeof _fileheader, &_fileheader, sizeof _fileheader);
+    memcpy_s(&filebuffer[sizeof _fileheader], headers_size, _frameheaders.data(), headers_size);
+    memcpy_s(&filebuffer[sizeof _fileheader + headers_size], pixels_size(), pixels(), pixels_size());
+    return true;
+}
+
+
+frame_cache::frame_cache(size_t budget) :_budget(budget)
+{
+}
+
+bool frame_cache::key::operator==(const key& other) const
+{
+    return file == other.file && generation == other.generation && index == other.index && scheme == other.scheme;
+}
+
+size_t frame_cache::key_hash::operator()(const key& value) const
+{
+    size_t hash = std::hash<const shpfile*>()(value.file);
+    hash = hash * 31 + value.generation;
+    hash = hash * 31 + value.index;
+    hash = hash * 31 + std::hash<std::string>()(value.scheme);
+    return hash;
+}
+
+frame_cache::frame_type frame_cache::frame(shpfile& file, size_t index, std::vector<byte> replace_scheme)
+{
+    key id{ &file, file.generation(), index, std::string(replace_scheme.begin(), replace_scheme.end()) };
+
+    std::promise<frame_type> decoded;
+    std::shared_future<frame_type> pending;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto iter = _lookup.find(id);
+        if (iter != _lookup.end())
+        {
+            _entries.splice(_entries.begin(), _entries, iter->second);
+            return iter->second->second;
+        }
+
+        auto decoding = _decoding.find(id);
+        if (decoding != _decoding.end())
+            pending = decoding->second;
+        else
+            _decoding.emplace(id, decoded.get_future().share());
+    }
+
+    //another thread is decoding this frame already, wait for it instead of decoding it twice
+    if (pending.valid())
+        return pending.get();
+
+    //decode outside the lock so misses on different frames don't serialize each other
+    frame_type frame;
+    try
+    {
+        frame = std::make_shared<const std::vector<byte>>(file.frame_view(index, replace_scheme));
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _decoding.erase(id);
+        decoded.set_exception(std::current_exception());
+        throw;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _decoding.erase(id);
+    decoded.set_value(frame);
+    if (frame->empty())
+        return frame;
+
+    _entries.emplace_front(id, frame);
+    _lookup[id] = _entries.begin();
+    _used += frame->size();
+    evict();
+
+    return frame;
+}
+
+void frame_cache::clear()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _lookup.clear();
+    _entries.clear();
+    _used = 0;
+}
+
+size_t frame_cache::budget()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _budget;
+}
+
+size_t frame_cache::used()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _used;
+}
+
+void frame_cache::set_budget(size_t budget)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _budget = budget;
+    evict();
+}
+
+void frame_cache::evict()
+{
+    //callers keep their own reference, so dropping an entry never invalidates a returned frame
+    while (_used > _budget && !_entries.empty())
+    {
+        auto& oldest = _entries.back();
+        _used -= oldest.second->size();
+        _lookup.erase(oldest.first);
+        _entries.pop_back();
+    }
+}
+
+pixel_pipeline& pixel_pipeline::add(pixel_stage& stage)
+{
+    _stages.push_back(&stage);
+    return *this;
+}
+
+void pixel_pipeline::process(const pixel_span& span)
+{
+    for (auto stage : _stages)
+        stage->process(span);
+}
+
+bool pixel_pipeline::run(tmpfile& file)
+{
+    if (!file.is_loaded())
+        return false;
+
+    //each unique tile once, duplicate blocks share it
+    for (size_t i = 0; i < file.valid_block_count(); i++)
+    {
+        byte* colors = file.color_data(i);
+        if (!colors)
+            return false;
+
+        process(pixel_span{ colors, file.tile_size(), 0, 0, i, ColorPlane, Normal });
+        if (byte* extras = file.extra_data(i))
+            process(pixel_span{ extras, file.extra_size(i), 0, 0, i, ExtraPlane, Normal });
+    }
+
+    return true;
+}
+
+bool pixel_pipeline::run(shpfile& file)
+{
+    if (!file.is_loaded())
+        return false;
+
+    for (size_t i = 0; i < file.frame_count(); i++)
+    {
+        shp_frame_kind kind = file.frame_kind(i);
+        if (kind == Empty)
+            continue;
+
+        byte* colors = file.pixel_data(i);
+        shp_frame_header& header = file._frameheaders[i];
+        shp_compression compression = file.frame_compression(i);
+        size_t width = header.width;
+
+        for (size_t l = 0; l < header.height; l++)
+        {
+            size_t size;
+            byte* line = file.next_line(colors, width, compression, size);
+            if (!line)
+                break;
+
+            if (compression != RunLengthZero)
+            {
+                process(pixel_span{ line, std::min<size_t>(size, width), 0, l, i, FramePlane, kind });
+                continue;
+            }
+
+            size_t position = 0;
+            size_t column = 0;
+            while (position < size && column < width)
+            {
+                size_t literals = shpfile::find_zero(line + position, size - position);
+                if (literals)
+                    process(pixel_span{ line + position, std::min<size_t>(literals, width - column), column, l, i, FramePlane, kind });
+
+                column += literals;
+                position += literals;
+                if (position + 1 < size && column < width)
+                {
+                    size_t zeros = std::min<size_t>(line[position + 1], width - column);
+                    process(pixel_span{ nullptr, zeros, column, l, i, FramePlane, kind });
+                    column += zeros;
+                }
+                position += 2;
+            }
+        }
+    }
+
+    //an untouched file keeps its generation, so frame_cache entries for it stay valid
+    if (std::any_of(_stages.begin(), _stages.end(), [](pixel_stage* stage) { return stage->writes(); }))
+        file.touch();
+    return true;
+}
+
+remap_stage::remap_stage(std::vector<byte> replace_scheme) :_scheme(replace_scheme)
+{
+    const size_t valid_replace_count = 256;
+    if (_scheme.size() != valid_replace_count)
+        _scheme.clear();
+}
+
+void remap_stage::process(const pixel_span& span)
+{
+    if (!span.pixels || span.kind != Normal || _scheme.empty())
+        return;
+
+    remap_bytes(span.pixels, span.count, _scheme.data());
+}
+
+bool remap_stage::writes()
+{
+    return !_scheme.empty();
+}
+
+void histogram_stage::process(const pixel_span& span)
+{
+    if (!span.pixels)
+    {
+        _counts[0] += span.count;
+        return;
+    }
+
+    for (size_t i = 0; i < span.count; i++)
+        ++_counts[span.pixels[i]];
+}
+
+size_t histogram_stage::operator[](size_t index)
+{
+    return index < 256 ? _counts[index] : 0;
+}
+
+void checksum_stage::process(const pixel_span& span)
+{
+    for (size_t i = 0; i < span.count; i++)
+        _hash = (_hash ^ (span.pixels ? span.pixels[i] : 0)) * 1099511628211ull;
+}
+
+uint64_t checksum_stage::value()
+{
+    return _hash;
+}
+
+void bounds_stage::process(const pixel_span& span)
+{
+    size_t first, last;
+    if (span.plane != FramePlane || !span.pixels || !shpfile::opaque_bounds(span.pixels, span.count, first, last))
+        return;
+
+    auto found = _extents.find(span.item);
+    if (found == _extents.end())
+    {
+        _extents[span.item] = extent{ span.x + first, span.y, span.x + last, span.y };
+        return;
+    }
+
+    extent& frame = found->second;
+    frame.left = std::min<size_t>(frame.left, span.x + first);
+    frame.right = std::max<size_t>(frame.right, span.x + last);
+    frame.top = std::min<size_t>(frame.top, span.y);
+    frame.bottom = std::max<size_t>(frame.bottom, span.y);
+}
+
+rectangle bounds_stage::bound(size_t frame)
+{
+    auto found = _extents.find(frame);
+    if (found == _extents.end())
+        return rectangle{ 0,0,0,0 };
+
+    extent& opaque = found->second;
+    return rectangle{ static_cast<int32_t>(opaque.left), static_cast<int32_t>(opaque.top), opaque.right - opaque.left + 1, opaque.bottom - opaque.top + 1 };
+}
+
+admission_scheduler::admission_scheduler(size_t budget, size_t threads, estimate_type estimate) :_budget(budget), _estimate(estimate)
+{
+    _threads = std::max<size_t>(threads, 1);
+}
+
+size_t admission_scheduler::run(std::vector<std::string> filenames, convert_type convert)
+{
+    {
+        //estimating opens every file, so leave it to the workers instead of delaying the first conversion
+        std::lock_guard<std::mutex> lock(_mutex);
+        _pending.clear();
+        _unestimated.assign(filenames.begin(), filenames.end());
+    }
+
+    std::atomic<size_t> converted{ 0 };
+    auto work = [this, &convert, &converted]()
+    {
+        job current;
+        while (admit(current))
+        {
+            if (convert(current.filename))
+                ++converted;
+            release(current.cost);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < std::min<size_t>(_threads, filenames.size()); i++)
+        threads.emplace_back(work);
+    for (auto& thread : threads)
+        thread.join();
+
+    return converted;
+}
+
+size_t admission_scheduler::peak()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _peak;
+}
+
+bool admission_scheduler::admit(job& admitted)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_pending.empty() || !_unestimated.empty())
+    {
+        //the largest file that still fits, so small files keep the other threads busy while a large one waits
+        size_t available = _budget > _in_flight ? _budget - _in_flight : 0;
+        auto fits = std::upper_bound(_pending.begin(), _pending.end(), available, [](size_t cost, const job& pending) { return cost < pending.cost; });
+
+        auto chosen = _pending.end();
+        if (fits != _pending.begin())
+        {
+            chosen = std::prev(fits);
+        }
+        else if (!_unestimated.empty())
+        {
+            //nothing known fits, estimate the next file outside the lock and look again
+            job estimated{ 0, _unestimated.front() };
+            _unestimated.pop_front();
+
+            lock.unlock();
+            estimated.cost = _estimate(estimated.filename);
+            lock.lock();
+
+            auto position = std::upper_bound(_pending.begin(), _pending.end(), estimated.cost, [](size_t cost, const job& pending) { return cost < pending.cost; });
+            _pending.insert(position, estimated);
+            continue;
+        }
+        else if (!_in_flight)
+        {
+            chosen = std::prev(_pending.end());//over budget on its own, run it alone rather than never
+        }
+
+        if (chosen == _pending.end())
+        {
+            _released.wait(lock);
+            continue;
+        }
+
+        admitted = *chosen;
+        _pending.erase(chosen);
+        _in_flight += admitted.cost;
+        _peak = std::max<size_t>(_peak, _in_flight);
+        return true;
+    }
+
+    return false;
+}
+
+void admission_scheduler::release(size_t cost)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _in_flight -= cost;
+    }
+    _released.notify_all();
+}
+
+batch_coordinator::batch_coordinator(std::string executable, std::string options, size_t workers, size_t threads, size_t budget) :_executable(executable), _options(options), _budget(budget)
+{
+    _workers = std::min<size_t>(std::max<size_t>(workers, 1), MAXIMUM_WAIT_OBJECTS);
+    _threads = std::max<size_t>(threads, 1);
+}
+
+const char* batch_coordinator::worker_switch()
+{
+    return "--worker";
+}
+
+size_t batch_coordinator::file_size(const std::string& filename)
+{
+    std::ifstream file(filename, std::ios::in | std::ios::binary);
+    if (!file)
+        return 0;
+    return file.seekg(0, std::ios::end).tellg();
+}
+
+batch_coordinator::shard batch_coordinator::make_shard(std::vector<std::string> files)
+{
+    char temp_path[MAX_PATH]{ 0 };
+    GetTempPathA(sizeof temp_path, temp_path);
+
+    shard result;
+    result.name = std::string(temp_path) + "shptmp_" + std::to_string(GetCurrentProcessId()) + "_" + std::to_string(_shard_serial++) + ".shard";
+    result.files = files;
+    return result;
+}
+
+std::vector<batch_coordinator::shard> batch_coordinator::split(std::vector<std::string> filenames)
+{
+    std::vector<std::pair<size_t, std::string>> sized_files;
+    for (auto& filename : filenames)
+        sized_files.emplace_back(file_size(filename), filename);
+
+    //largest file first, each one into the currently lightest shard
+    std::stable_sort(sized_files.begin(), sized_files.end(), [](auto& left, auto& right) { return left.first > right.first; });
+
+    size_t shard_count = std::min<size_t>(_workers, filenames.size());
+    std::vector<std::vector<std::string>> buckets(shard_count);
+    std::vector<size_t> loads(shard_count, 0);
+    for (auto& sized_file : sized_files)
+    {
+        size_t lightest = std::min_element(loads.begin(), loads.end()) - loads.begin();
+        loads[lightest] += sized_file.first + 1;//+1 keeps empty files spread by count
+        buckets[lightest].push_back(sized_file.second);
+    }
+
+    std::vector<shard> shards;
+    for (auto& bucket : buckets)
+        shards.push_back(make_shard(bucket));
+    return shards;
+}
+
+bool batch_coordinator::launch(size_t worker_index, shard& work, worker& launched)
+{
+    std::ofstream list(work.name, std::ios::out | std::ios::trunc);
+    if (!list)
+        return false;
+
+    for (auto& filename : work.files)
+        list << filename << '\n';
+    list.close();
+    DeleteFileA((work.name + ".progress").c_str());
+
+    std::string command = "\"" + _executable + "\" " + _options + worker_switch() + " " + std::to_string(worker_index) + " \"" + work.name + "\" "
+        + std::to_string(_threads) + " " + std::to_string(_budget / _workers);
+    std::vector<char> command_line(command.begin(), command.end());
+    command_line.push_back('\0');
+
+    STARTUPINFOA startup{ 0 };
+    PROCESS_INFORMATION process{ 0 };
+    startup.cb = sizeof startup;
+    if (!CreateProcessA(nullptr, command_line.data(), nullptr, nullptr, FALSE, 0, nullptr, nullptr, &startup, &process))
+    {
+        DeleteFileA(work.name.c_str());
+        return false;
+    }
+
+    CloseHandle(process.hThread);
+    launched.process = process.hProcess;
+    launched.work = work;
+    return true;
+}
+
+void batch_coordinator::collect(worker& finished, DWORD exit_code, batch_statistics& statistics, std::deque<shard>& pending)
+{
+    std::vector<std::string>& files = finished.work.files;
+    std::vector<char> states(files.size(), 0);
+
+    //progress lines are "begin <index>" followed by "ok <index>" or "fail <index>"
+    std::ifstream progress(finished.work.name + ".progress");
+    std::string state;
+    size_t index;
+    while (progress >> state >> index)
+    {
+        if (index < states.size() && !state.empty())
+            states[index] = state.front();
+    }
+    progress.close();
+
+    std::vector<std::string> in_flight;
+    std::vector<std::string> remaining;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        if (states[i] == 'o')
+        {
+            ++statistics.converted;
+            statistics.bytes += file_size(files[i]);
+        }
+        else if (states[i] == 'f')
+        {
+            ++statistics.failed;
+        }
+        else if (states[i] == 'b')
+        {
+            in_flight.push_back(files[i]);
+        }
+        else
+        {
+            remaining.push_back(files[i]);
+        }
+    }
+
+    //a worker that never began a file failed to start rather than crashed, a retry would go the same way
+    bool started = std::any_of(states.begin(), states.end(), [](char state) { return state != 0; });
+    if (!exit_code || exit_code == shard_unreadable || !started)
+    {
+        statistics.failed += in_flight.size() + remaining.size();
+    }
+    else
+    {
+        ++statistics.crashed_workers;
+
+        //a single file in flight is the culprit, several each get a shard of their own so a repeated crash names the file
+        if (in_flight.size() == 1)
+        {
+            statistics.quarantined.push_back(in_flight.front());
+        }
+        else
+        {
+            for (auto& filename : in_flight)
+            {
+                pending.push_back(make_shard({ filename }));
+                ++statistics.requeued_shards;
+            }
+        }
+
+        if (!remaining.empty())
+        {
+            pending.push_back(make_shard(remaining));
+            ++statistics.requeued_shards;
+        }
+    }
+
+    DeleteFileA(finished.work.name.c_str());
+    DeleteFileA((finished.work.name + ".progress").c_str());
+}
+
+batch_statistics batch_coordinator::run(std::vector<std::string> filenames)
+{
+    batch_statistics statistics;
+    std::deque<shard> pending;
+    for (auto& work : split(filenames))
+        pending.push_back(work);
+
+    std::vector<worker> slots(_workers, worker{ nullptr });
+    size_t running = 0;
+    while (!pending.empty() || running)
+    {
+        for (size_t i = 0; i < slots.size() && !pending.empty(); i++)
+        {
+            if (slots[i].process)
+                continue;
+
+            shard work = pending.front();
+            pending.pop_front();
+            if (!launch(i, work, slots[i]))
+            {
+                //the worker can't even be started, retrying the shard would fail the same way
+                statistics.failed += work.files.size();
+                continue;
+            }
+            ++running;
+        }
+
+        if (!running)
+            break;
+
+        std::vector<HANDLE> handles;
+        std::vector<size_t> owners;
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            if (!slots[i].process)
+                continue;
+            handles.push_back(slots[i].process);
+            owners.push_back(i);
+        }
+
+        DWORD result = WaitForMultipleObjects(static_cast<DWORD>(handles.size()), handles.data(), FALSE, INFINITE);
+        if (result - WAIT_OBJECT_0 >= handles.size())
+            break;
+
+        worker& finished = slots[owners[result - WAIT_OBJECT_0]];
+        DWORD exit_code = 0;
+        GetExitCodeProcess(finished.process, &exit_code);
+        CloseHandle(finished.process);
+        finished.process = nullptr;
+        --running;
+
+        collect(finished, exit_code, statistics, pending);
+    }
+
+    //workers are only left running when waiting on them failed, let them finish so no process or shard file is left behind
+    for (auto& running_worker : slots)
+    {
+        if (!running_worker.process)
+            continue;
+
+        WaitForSingleObject(running_worker.process, INFINITE);
+        DWORD exit_code = 0;
+        GetExitCodeProcess(running_worker.process, &exit_code);
+        CloseHandle(running_worker.process);
+        running_worker.process = nullptr;
+
+        collect(running_worker, exit_code, statistics, pending);
+    }
+
+    for (auto& work : pending)
+        statistics.failed += work.files.size();
+
+    return statistics;
+}
+
+void batch_coordinator::pin_to_numa_node(size_t worker_index)
+{
+    ULONG highest_node = 0;
+    if (!GetNumaHighestNodeNumber(&highest_node) || !highest_node)
+        return;
+
+    //pin before any file is read so its buffers are first touched on the local node
+    UCHAR node = static_cast<UCHAR>(worker_index % (highest_node + 1));
+    ULONGLONG mask = 0;
+    if (GetNumaNodeProcessorMask(node, &mask) && mask)
+        SetProcessAffinityMask(GetCurrentProcess(), static_cast<DWORD_PTR>(mask));
+}
+
+int batch_coordinator::run_worker(size_t worker_index, std::string shardname, admission_scheduler& scheduler, convert_type convert)
+{
+    pin_to_numa_node(worker_index);
+
+    std::ifstream list(shardname);
+    if (!list)
+        return shard_unreadable;
+
+    std::vector<std::string> files;
+    std::string line;
+    while (std::getline(list, line))
+    {
+        if (!line.empty())
+            files.push_back(line);
+    }
+    list.close();
+
+    std::unordered_map<std::string, size_t> indices;
+    for (size_t i = 0; i < files.size(); i++)
+        indices[files[i]] = i;
+
+    std::ofstream progress(shardname + ".progress", std::ios::out | std::ios::app);
+    std::mutex progress_mutex;
+    auto logged_convert = [&](const std::string& filename)->bool
+    {
+        size_t index = indices[filename];
+        {
+            //flushed before converting so the coordinator knows which file a crash happened on
+            std::lock_guard<std::mutex> lock(progress_mutex);
+            progress << "begin " << index << std::endl;
+        }
+
+        bool converted = convert(filename);
+
+        std::lock_guard<std::mutex> lock(progress_mutex);
+        progress << (converted ? "ok " : "fail ") << index << std::endl;
+        return converted;
+    };
+
+    scheduler.run(files, logged_convert);
+    return 0;
+}
+
+directory_watcher::directory_watcher(std::vector<std::string> directories, std::vector<std::string> extensions, size_t debounce)
+    :_extensions(extensions), _debounce(debounce)
+{
+    for (auto& extension : _extensions)
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+    _stop = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+    for (auto& directory : directories)
+    {
+        auto target = std::make_unique<watch>();
+        target->path = directory;
+        if (!target->path.empty() && target->path.back() != '\\' && target->path.back() != '/')
+            target->path += '\\';
+
+        target->directory = CreateFileA(directory.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+            nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+        if (target->directory == INVALID_HANDLE_VALUE)
+            continue;
+
+        memset(&target->overlapped, 0, sizeof target->overlapped);
+        target->overlapped.hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+        target->buffer.resize(0x4000);
+        if (!listen(*target))
+        {
+            CloseHandle(target->overlapped.hEvent);
+            CloseHandle(target->directory);
+            continue;
+        }
+
+        _watches.push_back(std::move(target));
+    }
+}
+
+directory_watcher::~directory_watcher()
+{
+    for (auto& target : _watches)
+    {
+        CancelIo(target->directory);
+        CloseHandle(target->directory);
+        CloseHandle(target->overlapped.hEvent);
+    }
+
+    if (_stop)
+        CloseHandle(_stop);
+}
+
+bool directory_watcher::is_watching()
+{
+    return !_watches.empty();
+}
+
+void directory_watcher::stop()
+{
+    SetEvent(_stop);
+}
+
+bool directory_watcher::listen(watch& target)
+{
+    ResetEvent(target.overlapped.hEvent);
+    return ReadDirectoryChangesW(target.directory, target.buffer.data(), static_cast<DWORD>(target.buffer.size() * sizeof DWORD), TRUE,
+        FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE, nullptr, &target.overlapped, nullptr);
+}
+
+bool directory_watcher::matches(const std::string& filename)
+{
+    size_t dot = filename.find_last_of('.');
+    if (dot == std::string::npos)
+        return false;
+
+    std::string extension = filename.substr(dot);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    return std::find(_extensions.begin(), _extensions.end(), extension) != _extensions.end();
+}
+
+ULONGLONG directory_watcher::last_write(const std::string& filename)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!GetFileAttributesExA(filename.c_str(), GetFileExInfoStandard, &attributes))
+        return 0;
+    return (static_cast<ULONGLONG>(attributes.ftLastWriteTime.dwHighDateTime) << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+}
+
+void directory_watcher::collect(watch& source, ULONGLONG now)
+{
+    DWORD transferred = 0;
+    if (!GetOverlappedResult(source.directory, &source.overlapped, &transferred, FALSE))
+        return;
+
+    //zero bytes means the buffer overflowed and this batch of events is lost
+    const byte* cursor = reinterpret_cast<const byte*>(source.buffer.data());
+    while (transferred)
+    {
+        auto information = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(cursor);
+        if (information->Action == FILE_ACTION_ADDED || information->Action == FILE_ACTION_MODIFIED || information->Action == FILE_ACTION_RENAMED_NEW_NAME)
+        {
+            int length = static_cast<int>(information->FileNameLength / sizeof WCHAR);
+            int size = WideCharToMultiByte(CP_ACP, 0, information->FileName, length, nullptr, 0, nullptr, nullptr);
+            std::string name(size, '\0');
+            WideCharToMultiByte(CP_ACP, 0, information->FileName, length, &name[0], size, nullptr, nullptr);
+
+            if (matches(name))
+                _pending[source.path + name] = now;
+        }
+
+        if (!information->NextEntryOffset)
+            break;
+        cursor += information->NextEntryOffset;
+    }
+}
+
+void directory_watcher::run(batch_type convert)
+{
+    if (!is_watching())
+        return;
+
+    ResetEvent(_stop);
+    while (true)
+    {
+        std::vector<HANDLE> events;
+        for (auto& target : _watches)
+            events.push_back(target->overlapped.hEvent);
+        events.push_back(_stop);
+
+        //sleep until the oldest pending file has been quiet for the debounce interval
+        ULONGLONG now = GetTickCount64();
+        DWORD timeout = INFINITE;
+        for (auto& pending : _pending)
+            timeout = static_cast<DWORD>(std::min<ULONGLONG>(timeout, pending.second + _debounce > now ? pending.second + _debounce - now : 0));
+
+        DWORD result = WaitForMultipleObjects(static_cast<DWORD>(events.size()), events.data(), FALSE, timeout);
+        now = GetTickCount64();
+        if (result == WAIT_OBJECT_0 + _watches.size() || result == WAIT_FAILED)
+            break;
+
+        if (result != WAIT_TIMEOUT)
+        {
+            watch& source = *_watches[result - WAIT_OBJECT_0];
+            collect(source, now);
+            listen(source);
+        }
+
+        //sweep after every wake, a steady stream of unrelated events would otherwise hold back files already due
+        std::vector<std::string> batch;
+        for (auto iter = _pending.begin(); iter != _pending.end();)
+        {
+            if (iter->second + _debounce > now)
+            {
+                ++iter;
+                continue;
+            }
+
+            //our own save fires the same events, skip files untouched since we wrote them
+            auto written = _written.find(iter->first);
+            if (written == _written.end() || written->second != last_write(iter->first))
+                batch.push_back(iter->first);
+            iter = _pending.erase(iter);
+        }
+
+        if (batch.empty())
+            continue;
+
+        std::vector<ULONGLONG> written = convert(batch);
+        for (size_t i = 0; i < batch.size() && i < written.size(); i++)
+            _written[batch[i]] = written[i];
+    }
+}
 
 void config::trim(std::string& string, const char* filter)
 {
@@ -11,11 +11,22 @@
 
 //containers
 #include <memory>
+#include <functional>
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
+#include <list>
 #include <algorithm>
 
+//threading
+#include <atomic>
+#include <mutex>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#include <future>
+
 #define CLASSES_START namespace thomas{
 #define CLASSES_END };
 
@@ -56,6 +67,20 @@ struct tmp_image_header
 	std::vector<byte> pixels;
 };
 
+//tile geometries common enough to get their tmp kernels specialized at compile time
+template<size_t block_width, size_t block_height>
+struct tmp_geometry
+{
+	static constexpr size_t width = block_width;
+	static constexpr size_t height = block_height;
+	static constexpr size_t tile_size = block_width * block_height / 2;//0 means read it from the file header
+	static constexpr size_t payload_size = tile_size * 2;//colors and zbuffer, the extra image follows
+};
+
+using ts_geometry = tmp_geometry<48, 24>;
+using ra2_geometry = tmp_geometry<60, 30>;
+using generic_geometry = tmp_geometry<0, 0>;
+
 struct color
 {
 	byte r;
@@ -73,12 +98,18 @@ public:
 	//load and clear
 	void clear();
 	bool is_loaded();
-	bool load(std::string filename);
+	bool load(std::string filename, bool lazy = false);//lazy reads headers only, payloads on first access
+	bool load(const byte* data, size_t size);
+	static size_t estimate_memory(std::string filename);
+
+	static constexpr size_t no_tile = SIZE_MAX;
 
 	//data accessing
 	size_t block_count();
-	size_t valid_block_count();
+	size_t valid_block_count();//unique tiles, duplicate blocks share one
+	size_t block_tile(size_t block);//tile index of a block, no_tile for an empty one
 	size_t tile_size();
+	const tmp_image_header* tile_header(size_t index);//metadata only, pixels stay empty for a lazy file until fetched
 	byte* color_data(size_t index);
 	byte* zbuffer_data(size_t index);
 	bool has_extra(size_t index);
@@ -88,15 +119,36 @@ public:
 
 	//data modifier
 	bool color_replace(std::vector<byte> replace_scheme);
+	static bool color_replace(byte* data, size_t size, std::vector<byte> replace_scheme);//remaps a whole file image in place
 
 	//save 
 	size_t calculate_file_size();
 	bool save(std::string filename);
+	bool save(std::vector<byte>& filebuffer);
 
 private:
+	bool load_tiles(const byte* data, size_t size, const std::vector<uint32_t>& offsets);
+
+	//geometry kernels, build with _TMP_GENERIC_GEOMETRY to always take the generic path
+	template<typename kernel> auto dispatch_geometry(kernel run);
+	template<typename geometry> bool remap_tiles(const byte* replace_scheme);
+
+	//sizes read from the file are capped so the products below them can't wrap
+	static constexpr size_t max_dimension = 0x1000;
+	static bool valid_geometry(const tmp_file_header& header);
+	static bool payload_fits(const tmp_image_header& header, size_t tile, size_t available);
+
+	static size_t tile_hash(const tmp_image_header& tile);
+	bool load_index(std::string filename);
+	bool fetch(size_t index);
+	bool fetch(size_t index, std::ifstream& source);
+	bool materialize();
+
 	tmp_file_header _fileheader{ 0 };
 	std::vector<tmp_image_header> _imageheaders;
-	std::vector<uint32_t> _original_offsets;
+	std::vector<size_t> _block_indices;//per block, index into _imageheaders or no_tile
+	std::vector<uint32_t> _tile_offsets;//lazy only, file offset of each tile header
+	std::string _source;//lazy only, file the payloads are read from until every one is fetched
 };
 
 struct rectangle
@@ -115,6 +167,20 @@ struct shp_file_header
 	uint16_t frames;
 };
 
+enum shp_compression :byte
+{
+	Raw = 1,//rows stored as-is, width * height bytes
+	Lined = 2,//each row prefixed by its uint16 length, no run-length
+	RunLengthZero = 3//each row prefixed by its uint16 length, zeros stored as (0, count)
+};
+
+enum shp_frame_kind :byte
+{
+	Normal,
+	Shadow,//second half frame that only uses indices 0 and 1
+	Empty//no pixel data or zero-sized
+};
+
 struct shp_frame_header
 {
 	int16_t x;
@@ -138,24 +204,198 @@ public:
 	void clear();
 	bool is_loaded();
 	bool load(std::string filename);
+	bool load(const byte* data, size_t size);
+	bool attach(byte* data, size_t size);//like load, but pixels stay in data, which must outlive this shpfile
+	static size_t estimate_memory(std::string filename, bool crop = false);//crop adds what crop_frames holds on top
 
 	//data accessing
 	size_t frame_count();
 	byte* pixel_data(size_t index);
 	rectangle frame_bound(size_t index);
 	rectangle file_bound();
+	shp_compression frame_compression(size_t index);
+	shp_frame_kind frame_kind(size_t index);
+	size_t generation();
+
+	//decodes a frame into a file_bound() sized indexed bitmap, remapped when a 256 entry scheme is given
+	std::vector<byte> frame_view(size_t index, std::vector<byte> replace_scheme = {});
 
 	//data modifier
 	bool color_replace(std::vector<byte> replace_scheme);
+	size_t crop_frames();//shrinks every frame to its opaque pixels, returns the bytes saved
 
 	//save
 	size_t calculate_file_size();
 	bool save(std::string filename);
+	bool save(std::vector<byte>& filebuffer);
 
 private:
+	friend class pixel_pipeline;
+	friend class bounds_stage;
+
+	bool load_headers(const byte* data, size_t size);
+	void classify_frames();
+	byte* pixels();
+	size_t pixels_size();
+
+	//decoding kernels
+	static size_t find_zero(const byte* data, size_t size);
+	static void remap_zero_line(byte* line, size_t size, const byte* replace_scheme);
+	static bool is_shadow_span(const byte* data, size_t size);
+	static bool opaque_bounds(const byte* row, size_t width, size_t& first, size_t& last);
+	static bool encode_line(const byte* row, size_t width, shp_compression compression, std::vector<byte>& payload);
+	byte* next_line(byte*& cursor, size_t width, shp_compression compression, size_t& size);
+	size_t payload_size(size_t index);
+	void decode_frame(size_t index, byte* target, size_t target_width, size_t target_height, int64_t x, int64_t y, const byte* replace_scheme);
+	shp_frame_kind classify_frame(size_t index);
+	void touch();
+
 	shp_file_header _fileheader{ 0 };
 	std::vector<shp_frame_header> _frameheaders;
+	std::vector<shp_frame_kind> _framekinds;
 	std::vector<byte> _pixels;
+	byte* _attached = nullptr;//caller owned pixels when attached, _pixels is unused then
+	size_t _attached_size = 0;
+	size_t _generation = 0;
+};
+
+//thread-safe lru cache of decoded frame views, bounded by the total bytes of cached bitmaps
+class frame_cache
+{
+public:
+	using frame_type = std::shared_ptr<const std::vector<byte>>;
+
+	frame_cache(size_t budget);
+	~frame_cache() = default;
+
+	frame_type frame(shpfile& file, size_t index, std::vector<byte> replace_scheme = {});
+	void clear();
+	size_t budget();
+	size_t used();
+	void set_budget(size_t budget);
+
+private:
+	struct key
+	{
+		const shpfile* file;
+		size_t generation;
+		size_t index;
+		std::string scheme;
+
+		bool operator==(const key& other) const;
+	};
+
+	struct key_hash
+	{
+		size_t operator()(const key& value) const;
+	};
+
+	using entry_list = std::list<std::pair<key, frame_type>>;
+
+	void evict();
+
+	entry_list _entries;//most recently used first
+	std::unordered_map<key, entry_list::iterator, key_hash> _lookup;
+	std::unordered_map<key, std::shared_future<frame_type>, key_hash> _decoding;//misses being decoded, later requesters wait on them
+	size_t _budget = 0;
+	size_t _used = 0;
+	std::mutex _mutex;
+};
+
+enum pixel_plane :byte
+{
+	ColorPlane,//tmp tile colors
+	ExtraPlane,//tmp extra image colors
+	FramePlane//shp frame pixels
+};
+
+//a run of pixels handed to every stage of a pixel_pipeline in turn
+struct pixel_span
+{
+	byte* pixels;//nullptr for a transparent run that is only stored as a count
+	size_t count;
+	size_t x;//position of the first pixel inside its frame, 0 for tmp planes
+	size_t y;
+	size_t item;//tile or frame index
+	pixel_plane plane;
+	shp_frame_kind kind;//Normal for tmp planes
+};
+
+class pixel_stage
+{
+public:
+	virtual ~pixel_stage() = default;
+	virtual void process(const pixel_span& span) = 0;//may rewrite span.pixels, later stages see the result
+	virtual bool writes() { return false; }//stages that rewrite pixels must say so, the file is marked changed only then
+};
+
+//runs every registered stage over each span while it is still in cache, so chained passes cost one sweep
+class pixel_pipeline
+{
+public:
+	pixel_pipeline() = default;
+	~pixel_pipeline() = default;
+
+	pixel_pipeline& add(pixel_stage& stage);
+	bool run(tmpfile& file);
+	bool run(shpfile& file);
+
+private:
+	void process(const pixel_span& span);
+
+	std::vector<pixel_stage*> _stages;//not owned
+};
+
+//same rules as color_replace: shadow frames are left alone, a scheme that isn't 256 entries does nothing
+class remap_stage :public pixel_stage
+{
+public:
+	remap_stage(std::vector<byte> replace_scheme);
+	void process(const pixel_span& span) override;
+	bool writes() override;
+
+private:
+	std::vector<byte> _scheme;
+};
+
+//transparent runs count towards index 0
+class histogram_stage :public pixel_stage
+{
+public:
+	void process(const pixel_span& span) override;
+	size_t operator[](size_t index);
+
+private:
+	size_t _counts[256]{ 0 };
+};
+
+//fnv-1a over the decoded pixels, transparent runs hash as zeros so the value doesn't depend on compression
+class checksum_stage :public pixel_stage
+{
+public:
+	void process(const pixel_span& span) override;
+	uint64_t value();
+
+private:
+	uint64_t _hash = 14695981039346656037ull;
+};
+
+class bounds_stage :public pixel_stage
+{
+public:
+	void process(const pixel_span& span) override;
+	rectangle bound(size_t frame);//opaque pixels of a frame in frame coordinates, empty when it has none
+
+private:
+	struct extent
+	{
+		size_t left;
+		size_t top;
+		size_t right;
+		size_t bottom;
+	};
+
+	std::unordered_map<size_t, extent> _extents;
 };
 
 class palette
@@ -166,6 +406,7 @@ public:
 	~palette() = default;
 	
 	bool load(std::string filename);
+	bool load(const byte* data, size_t size);
 	void clear();
 	bool is_loaded();
 	std::vector<byte> convert_color(palette& target);
@@ -214,4 +455,130 @@ private:
 	config_type _config;
 };
 
+//runs conversions on a thread pool, admitting a file only while the estimated bytes of all files in flight fit the budget
+class admission_scheduler
+{
+public:
+	using estimate_type = std::function<size_t(std::string)>;
+	using convert_type = std::function<bool(const std::string&)>;
+
+	admission_scheduler(size_t budget, size_t threads, estimate_type estimate);
+	~admission_scheduler() = default;
+
+	size_t run(std::vector<std::string> filenames, convert_type convert);
+	size_t peak();
+
+private:
+	struct job
+	{
+		size_t cost;
+		std::string filename;
+	};
+
+	bool admit(job& admitted);
+	void release(size_t cost);
+
+	std::vector<job> _pending;//estimated, sorted by cost, largest last
+	std::deque<std::string> _unestimated;//estimated by the worker threads as they run short of admissible jobs
+	size_t _budget = 0;
+	size_t _threads = 1;
+	size_t _in_flight = 0;
+	size_t _peak = 0;
+	estimate_type _estimate;
+	std::mutex _mutex;
+	std::condition_variable _released;
+};
+
+struct batch_statistics
+{
+	size_t converted = 0;
+	size_t failed = 0;
+	size_t crashed_workers = 0;
+	size_t requeued_shards = 0;
+	size_t bytes = 0;
+	std::vector<std::string> quarantined;
+};
+
+//splits a file list into size-balanced shards and converts them in child processes of the same executable,
+//so a file that crashes the converter only takes down its own worker
+class batch_coordinator
+{
+public:
+	using convert_type = std::function<bool(const std::string&)>;
+
+	batch_coordinator(std::string executable, std::string options, size_t workers, size_t threads, size_t budget);
+	~batch_coordinator() = default;
+
+	batch_statistics run(std::vector<std::string> filenames);
+
+	//worker side, called from the child process with the arguments given by launch()
+	static int run_worker(size_t worker_index, std::string shardname, admission_scheduler& scheduler, convert_type convert);
+	static const char* worker_switch();
+
+private:
+	struct shard
+	{
+		std::string name;
+		std::vector<std::string> files;
+	};
+
+	struct worker
+	{
+		HANDLE process;
+		shard work;
+	};
+
+	std::vector<shard> split(std::vector<std::string> filenames);
+	shard make_shard(std::vector<std::string> files);
+	bool launch(size_t worker_index, shard& work, worker& launched);
+	void collect(worker& finished, DWORD exit_code, batch_statistics& statistics, std::deque<shard>& pending);
+	static size_t file_size(const std::string& filename);
+	static void pin_to_numa_node(size_t worker_index);
+
+	static constexpr int shard_unreadable = 2;//worker exit code when it can't read its shard list
+
+	std::string _executable;
+	std::string _options;//forwarded to every worker ahead of the worker switch
+	size_t _workers = 1;
+	size_t _threads = 1;
+	size_t _budget = 0;//shared by all workers
+	size_t _shard_serial = 0;
+};
+
+//watches directory trees for changed files and hands them over in debounced batches
+class directory_watcher
+{
+public:
+	//returns one last_write() per file, each taken right after that file was saved so later edits aren't mistaken for ours
+	using batch_type = std::function<std::vector<ULONGLONG>(const std::vector<std::string>&)>;
+
+	directory_watcher(std::vector<std::string> directories, std::vector<std::string> extensions, size_t debounce);
+	~directory_watcher();
+
+	bool is_watching();
+	void run(batch_type convert);//blocks until stop() is called
+	void stop();
+	static ULONGLONG last_write(const std::string& filename);
+
+private:
+	struct watch
+	{
+		std::string path;
+		HANDLE directory;
+		OVERLAPPED overlapped;
+		std::vector<DWORD> buffer;//DWORD aligned as ReadDirectoryChangesW requires
+	};
+
+	bool listen(watch& target);
+	void collect(watch& source, ULONGLONG now);
+	bool matches(const std::string& filename);
+
+	std::vector<std::unique_ptr<watch>> _watches;
+	std::vector<std::string> _extensions;
+	std::unordered_map<std::string, ULONGLONG> _pending;//file -> tick of its latest event
+	std::unordered_map<std::string, ULONGLONG> _written;//file -> last write time after we converted it
+	size_t _debounce = 0;
+	HANDLE _stop = nullptr;
+};
+
 CLASSES_END
\ No newline at end of file
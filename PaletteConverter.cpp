@@ -0,0 +1,86 @@
+#define PALCONV_EXPORTS
+#include "PaletteConverter.h"
+#include "Classes.h"
+
+//nothing may unwind across the c boundary, allocation failures are reported as a failed call
+#define PALCONV_GUARDED(expression) try { return (expression) ? 1 : 0; } catch (...) { return 0; }
+
+namespace
+{
+    std::vector<byte> make_scheme(const unsigned char* table)
+    {
+        return std::vector<byte>(table, table + PALCONV_TABLE_SIZE);
+    }
+
+    template<typename file_type>
+    bool convert(const unsigned char* data, size_t size, const unsigned char* table, unsigned char** output, size_t* output_size)
+    {
+        if (!table || !output || !output_size)
+            return false;
+
+        file_type file;
+        std::vector<byte> buffer;
+        if (!file.load(data, size) || !file.color_replace(make_scheme(table)) || !file.save(buffer))
+            return false;
+
+        *output = static_cast<unsigned char*>(malloc(buffer.size()));
+        if (!*output)
+            return false;
+
+        memcpy_s(*output, buffer.size(), buffer.data(), buffer.size());
+        *output_size = buffer.size();
+        return true;
+    }
+}
+
+int palconv_build_table(const unsigned char* source_palette, size_t source_size, const unsigned char* target_palette, size_t target_size, unsigned char table[PALCONV_TABLE_SIZE])
+{
+    auto build = [&]()->bool
+    {
+        thomas::palette source;
+        thomas::palette target;
+        if (!table || !source.load(source_palette, source_size) || !target.load(target_palette, target_size))
+            return false;
+
+        std::vector<byte> scheme = source.convert_color(target);
+        if (scheme.size() != PALCONV_TABLE_SIZE)
+            return false;
+
+        memcpy_s(table, PALCONV_TABLE_SIZE, scheme.data(), scheme.size());
+        return true;
+    };
+
+    PALCONV_GUARDED(build());
+}
+
+int palconv_remap_tmp(unsigned char* data, size_t size, const unsigned char table[PALCONV_TABLE_SIZE])
+{
+    PALCONV_GUARDED(table && thomas::tmpfile::color_replace(data, size, make_scheme(table)));
+}
+
+int palconv_remap_shp(unsigned char* data, size_t size, const unsigned char table[PALCONV_TABLE_SIZE])
+{
+    auto remap = [&]()->bool
+    {
+        //attached pixels are remapped where they are, only the frame headers are copied
+        thomas::shpfile file;
+        return table && file.attach(data, size) && file.color_replace(make_scheme(table));
+    };
+
+    PALCONV_GUARDED(remap());
+}
+
+int palconv_convert_tmp(const unsigned char* data, size_t size, const unsigned char table[PALCONV_TABLE_SIZE], unsigned char** output, size_t* output_size)
+{
+    PALCONV_GUARDED(convert<thomas::tmpfile>(data, size, table, output, output_size));
+}
+
+int palconv_convert_shp(const unsigned char* data, size_t size, const unsigned char table[PALCONV_TABLE_SIZE], unsigned char** output, size_t* output_size)
+{
+    PALCONV_GUARDED(convert<thomas::shpfile>(data, size, table, output, output_size));
+}
+
+void palconv_free(unsigned char* buffer)
+{
+    free(buffer);
+}
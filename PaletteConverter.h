@@ -0,0 +1,34 @@
+#pragma once
+//c interface over the converter classes, for hosts that keep tmp/shp/pal files in memory
+//build with PALCONV_EXPORTS defined to export these from a dll
+#include <stddef.h>
+
+#ifdef PALCONV_EXPORTS
+#define PALCONV_API __declspec(dllexport)
+#else
+#define PALCONV_API __declspec(dllimport)
+#endif
+
+#define PALCONV_TABLE_SIZE 256
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//every function returns nonzero on success and 0 on failure
+
+//builds a remap table from two 768 byte (6-bit) palettes
+PALCONV_API int palconv_build_table(const unsigned char* source_palette, size_t source_size, const unsigned char* target_palette, size_t target_size, unsigned char table[PALCONV_TABLE_SIZE]);
+
+//remaps a whole file image in place, the layout is unchanged so nothing is copied or allocated
+PALCONV_API int palconv_remap_tmp(unsigned char* data, size_t size, const unsigned char table[PALCONV_TABLE_SIZE]);
+PALCONV_API int palconv_remap_shp(unsigned char* data, size_t size, const unsigned char table[PALCONV_TABLE_SIZE]);
+
+//parses, remaps and serializes into a new buffer which must be released with palconv_free
+PALCONV_API int palconv_convert_tmp(const unsigned char* data, size_t size, const unsigned char table[PALCONV_TABLE_SIZE], unsigned char** output, size_t* output_size);
+PALCONV_API int palconv_convert_shp(const unsigned char* data, size_t size, const unsigned char table[PALCONV_TABLE_SIZE], unsigned char** output, size_t* output_size);
+PALCONV_API void palconv_free(unsigned char* buffer);
+
+#ifdef __cplusplus
+}
+#endif
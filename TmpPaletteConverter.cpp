@@ -22,21 +22,162 @@ int main(int argc, const char** argv)
 		return 1;
 	}
 	
-	uint32_t starttime = timeGetTime();
-	for (int i = 1; i < argc; i++)
+	//-j <workers> converts the files in that many child processes
+	//-t <threads> converts that many files at once in each process
+	//-m <megabytes> caps the estimated memory of all files in flight
+	//-c crops shp frames to their opaque pixels, shp converter only
+	//-w watches the [Watch] Directories of converter.ini and converts files as they change
+	int first_file = 1;
+	size_t workers = 0;
+	size_t threads = 1;
+	size_t budget = SIZE_MAX;
+	bool crop = false;
+	bool watch = false;
+	while (first_file < argc && argv[first_file][0] == '-')
 	{
+		const char* option = argv[first_file];
+#ifndef _SHP_CONVERTER
+		if (!strcmp(option, "-c"))
+		{
+			std::cout << "Cropping only applies to shp files.\n";
+			return 1;
+		}
+#endif
+
+		if (!strcmp(option, "-c") || !strcmp(option, "-w"))
+		{
+			crop |= !strcmp(option, "-c");
+			watch |= !strcmp(option, "-w");
+			first_file++;
+			continue;
+		}
+
+		if (first_file + 1 >= argc)
+			break;
 
+		size_t value = strtoull(argv[first_file + 1], nullptr, 10);
+		if (!strcmp(option, "-j"))
+			workers = value;
+		else if (!strcmp(option, "-t"))
+			threads = value;
+		else if (!strcmp(option, "-m"))
+			budget = value << 20;
+		else
+			break;
+
+		first_file += 2;
+	}
+
+	std::atomic<size_t> cropped_bytes{ 0 };
+	auto convert = [&replace_scheme, crop, &cropped_bytes](const std::string& filename)->bool
+	{
 #ifndef _SHP_CONVERTER
-		thomas::tmpfile file(argv[i]);
+		thomas::tmpfile file(filename);
 #else
-		thomas::shpfile file(argv[i]);
+		thomas::shpfile file(filename);
 #endif
 
 		if (!file.is_loaded())
-			std::cout << "File : " << argv[i] << " is not loaded.\n";
+		{
+			std::cout << "File : " << filename << " is not loaded.\n";
+			return false;
+		}
+
+		if (!file.color_replace(replace_scheme))
+			return false;
+
+#ifdef _SHP_CONVERTER
+		if (crop)
+			cropped_bytes += file.crop_frames();
+#endif
+
+		return file.save(filename);
+	};
+
+#ifndef _SHP_CONVERTER
+	auto estimate = thomas::tmpfile::estimate_memory;
+#else
+	auto estimate = [crop](const std::string& filename) { return thomas::shpfile::estimate_memory(filename, crop); };
+#endif
+
+	//internal: a child of -j mode converting one shard, started with the options above forwarded
+	if (argc - first_file == 5 && !strcmp(argv[first_file], thomas::batch_coordinator::worker_switch()))
+	{
+		const char** arguments = argv + first_file;
+		thomas::admission_scheduler scheduler(strtoull(arguments[4], nullptr, 10), atoi(arguments[3]), estimate);
+		return thomas::batch_coordinator::run_worker(atoi(arguments[1]), arguments[2], scheduler, convert);
+	}
+
+	if (watch)
+	{
+		thomas::config settings("converter.ini");
+		thomas::config::value_type directories = settings.value("Watch", "Directories");
+		thomas::config::value_type extensions = settings.value("Watch", "Extensions");
+		if (extensions.empty())
+		{
+#ifndef _SHP_CONVERTER
+			extensions = { ".tem", ".sno", ".urb", ".ubn", ".des", ".lun", ".tmp" };
+#else
+			extensions = { ".shp" };
+#endif
+		}
+
+		thomas::directory_watcher watcher(directories, extensions, settings.read_int("Watch", "Debounce", 100));
+		if (!watcher.is_watching())
+		{
+			std::cout << "No directories to watch.\n";
+			return 1;
+		}
+
+		thomas::admission_scheduler scheduler(budget, threads, estimate);
+		std::cout << "Watching for changes.\n";
+		watcher.run([&scheduler, &convert](const std::vector<std::string>& batch)
+		{
+			std::unordered_map<std::string, size_t> indices;
+			for (size_t i = 0; i < batch.size(); i++)
+				indices[batch[i]] = i;
+
+			//sampled per file as soon as it is saved, an edit made while the rest of the batch runs must still count as new
+			std::vector<ULONGLONG> written(batch.size(), 0);
+			uint32_t batchtime = timeGetTime();
+			scheduler.run(batch, [&](const std::string& filename)->bool
+			{
+				bool converted = convert(filename);
+				written[indices.at(filename)] = thomas::directory_watcher::last_write(filename);
+				return converted;
+			});
+
+			std::cout << batch.size() << " changed file(s) converted in " << (timeGetTime() - batchtime) / 1000.0 << " s.\n";
+			return written;
+		});
+		return 0;
+	}
+
+	uint32_t starttime = timeGetTime();
+	if (workers)
+	{
+		char executable[MAX_PATH]{ 0 };
+		GetModuleFileNameA(nullptr, executable, sizeof executable);
+
+		std::string options;
+		for (int i = 1; i < first_file; i++)
+			options += std::string(argv[i]) + " ";
+
+		thomas::batch_coordinator coordinator(executable, options, workers, threads, budget);
+		thomas::batch_statistics statistics = coordinator.run(std::vector<std::string>(argv + first_file, argv + argc));
+
+		std::cout << "Converted : " << statistics.converted << ", failed : " << statistics.failed << ", " << statistics.bytes << " bytes.\n";
+		std::cout << "Crashed workers : " << statistics.crashed_workers << ", requeued shards : " << statistics.requeued_shards << ".\n";
+		for (auto& filename : statistics.quarantined)
+			std::cout << "File : " << filename << " crashed the converter and was quarantined.\n";
+	}
+	else
+	{
+		thomas::admission_scheduler scheduler(budget, threads, estimate);
+		scheduler.run(std::vector<std::string>(argv + first_file, argv + argc), convert);
 
-		file.color_replace(replace_scheme);
-		file.save(argv[i]);
+		if (crop)
+			std::cout << "Cropping saved " << cropped_bytes << " bytes.\n";
 	}
 
 	std::cout << "All conversions for loaded files complete.\n";